@@ -0,0 +1,580 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bson_cache.h"
+
+#define CACHE_DEFAULT_SHARDS  16
+#define CACHE_MAX_SHARDS      256
+#define CACHE_INITIAL_BUCKETS 16
+
+/* Запомненный контекст вложенного блока */
+typedef struct BSON_Cache_Index_def
+{
+    char * path;
+    BSON_Context context;
+    struct BSON_Cache_Index_def * next;
+} BSON_Cache_Index;
+
+typedef struct BSON_Cache_Shard_def BSON_Cache_Shard;
+
+struct BSON_Cache_Entry_def
+{
+    char * file;
+    long offset;
+    unsigned hash;
+    /* Копия структуры документа, на нее указывают все контексты элемента */
+    BSON_Document document;
+    BSON_Context context;
+    BSON_Cache_Index * index;
+    /* Объем, учтенный в сегменте */
+    long charge;
+    int references;
+    /* 0, если элемент вытеснен, но еще удерживается пользователем */
+    int cached;
+    BSON_Cache_Shard * shard;
+    BSON_Cache_Entry * nextInBucket;
+    /* Список LRU: head — самый свежий элемент, tail — самый старый */
+    BSON_Cache_Entry * prev;
+    BSON_Cache_Entry * next;
+};
+
+struct BSON_Cache_Shard_def
+{
+    pthread_mutex_t lock;
+    BSON_Cache_Entry ** buckets;
+    long bucketCount;
+    long entries;
+    BSON_Cache_Entry * head;
+    BSON_Cache_Entry * tail;
+    long bytes;
+    unsigned long hits, misses, insertions, evictions;
+};
+
+struct BSON_Cache_def
+{
+    BSON_Cache_Shard * shards;
+    int shardCount;
+    long budget;
+    /* Общий для всех сегментов объем, бюджет между сегментами не делится */
+    atomic_long bytes;
+};
+
+/* FNV-1a по имени файла и смещению */
+static unsigned BSON_Cache_Hash(const char * file, long offset)
+{
+    unsigned hash = 2166136261u;
+    size_t i;
+
+    for(; *file; ++file)
+        hash = (hash ^ (byte)*file) * 16777619u;
+    for(i = 0; i < sizeof(long); ++i)
+        hash = (hash ^ (byte)(offset >> (8 * i))) * 16777619u;
+
+    return hash;
+}
+
+static BSON_Cache_Shard * BSON_Cache_Get_Shard(BSON_Cache * cache, unsigned hash)
+{
+    /* Старшие биты выбирают сегмент, младшие — корзину внутри сегмента */
+    return &cache->shards[(hash >> 16) & (cache->shardCount - 1)];
+}
+
+static BSON_Cache_Entry * BSON_Cache_Find(BSON_Cache_Shard * shard, const char * file,
+                                          long offset, unsigned hash)
+{
+    BSON_Cache_Entry * entry = shard->buckets[hash & (shard->bucketCount - 1)];
+
+    for(; entry; entry = entry->nextInBucket)
+        if(entry->hash == hash && entry->offset == offset && !strcmp(entry->file, file))
+            return entry;
+
+    return NULL;
+}
+
+static void BSON_Cache_Unlink_LRU(BSON_Cache_Shard * shard, BSON_Cache_Entry * entry)
+{
+    if(entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+
+    if(entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+}
+
+static void BSON_Cache_Push_LRU(BSON_Cache_Shard * shard, BSON_Cache_Entry * entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if(shard->head)
+        shard->head->prev = entry;
+    else
+        shard->tail = entry;
+    shard->head = entry;
+}
+
+static void BSON_Cache_Touch(BSON_Cache_Shard * shard, BSON_Cache_Entry * entry)
+{
+    if(shard->head == entry)
+        return;
+
+    BSON_Cache_Unlink_LRU(shard, entry);
+    BSON_Cache_Push_LRU(shard, entry);
+}
+
+/* При нехватке памяти таблица просто остается прежнего размера */
+static void BSON_Cache_Grow(BSON_Cache_Shard * shard)
+{
+    long i, newCount = shard->bucketCount * 2;
+    BSON_Cache_Entry ** buckets = (BSON_Cache_Entry **)calloc(newCount,
+                                                              sizeof(BSON_Cache_Entry *));
+    if(buckets == NULL)
+        return;
+
+    for(i = 0; i < shard->bucketCount; ++i)
+    {
+        BSON_Cache_Entry * entry = shard->buckets[i];
+        while(entry)
+        {
+            BSON_Cache_Entry * next = entry->nextInBucket;
+            BSON_Cache_Entry ** bucket = &buckets[entry->hash & (newCount - 1)];
+            entry->nextInBucket = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucketCount = newCount;
+}
+
+static void BSON_Cache_Free_Entry(BSON_Cache_Entry * entry)
+{
+    while(entry->index)
+    {
+        BSON_Cache_Index * next = entry->index->next;
+        free(entry->index->path);
+        free(entry->index);
+        entry->index = next;
+    }
+
+    free(entry->file);
+    free(entry);
+}
+
+/* Убирает элемент из сегмента. Память освобождается, только если его никто не держит */
+static void BSON_Cache_Remove(BSON_Cache * cache, BSON_Cache_Shard * shard,
+                              BSON_Cache_Entry * entry)
+{
+    BSON_Cache_Entry ** link = &shard->buckets[entry->hash & (shard->bucketCount - 1)];
+
+    while(*link != entry)
+        link = &(*link)->nextInBucket;
+    *link = entry->nextInBucket;
+    entry->nextInBucket = NULL;
+
+    BSON_Cache_Unlink_LRU(shard, entry);
+    shard->bytes -= entry->charge;
+    atomic_fetch_sub(&cache->bytes, entry->charge);
+    shard->entries--;
+    entry->cached = 0;
+
+    if(entry->references == 0)
+        BSON_Cache_Free_Entry(entry);
+}
+
+/*
+ *  Вытесняет элементы, пока общий объем превышает бюджет. Сначала освобождается
+ *  сегмент home, затем остальные по кругу. Одновременно держится не больше одной
+ *  блокировки, поэтому вызывать функцию можно только без захваченных сегментов.
+ *  Элемент keep (только что добавленный или использованный) не вытесняется.
+ */
+static void BSON_Cache_Trim(BSON_Cache * cache, BSON_Cache_Shard * home,
+                            const BSON_Cache_Entry * keep)
+{
+    int i, start = (int)(home - cache->shards);
+
+    for(i = 0; i < cache->shardCount && atomic_load(&cache->bytes) > cache->budget; ++i)
+    {
+        BSON_Cache_Shard * shard = &cache->shards[(start + i) & (cache->shardCount - 1)];
+
+        pthread_mutex_lock(&shard->lock);
+        while(atomic_load(&cache->bytes) > cache->budget && shard->tail &&
+              shard->tail != keep)
+        {
+            BSON_Cache_Remove(cache, shard, shard->tail);
+            shard->evictions++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+int BSON_Cache_Create(long budget, int shards, BSON_Cache ** cache)
+{
+    int i, count = 1;
+
+    if(cache == NULL)
+        return BSON_MEMORY_NOT_ALLOCATED;
+    if(budget < (long)sizeof(BSON_Cache_Entry))
+        return BSON_POS_OUT_OF_RANGE;
+
+    if(shards <= 0)
+        shards = CACHE_DEFAULT_SHARDS;
+    if(shards > CACHE_MAX_SHARDS)
+        shards = CACHE_MAX_SHARDS;
+    while(count < shards)
+        count <<= 1;
+
+    BSON_Cache * result = (BSON_Cache *)malloc(sizeof(BSON_Cache));
+    if(result == NULL)
+        return BSON_MEMORY_NOT_ALLOCATED;
+
+    result->shards = (BSON_Cache_Shard *)calloc(count, sizeof(BSON_Cache_Shard));
+    if(result->shards == NULL)
+    {
+        free(result);
+        return BSON_MEMORY_NOT_ALLOCATED;
+    }
+    result->shardCount = count;
+    result->budget = budget;
+    atomic_init(&result->bytes, 0);
+
+    for(i = 0; i < count; ++i)
+    {
+        BSON_Cache_Shard * shard = &result->shards[i];
+        shard->buckets = (BSON_Cache_Entry **)calloc(CACHE_INITIAL_BUCKETS,
+                                                     sizeof(BSON_Cache_Entry *));
+        if(shard->buckets == NULL)
+        {
+            while(i--)
+            {
+                pthread_mutex_destroy(&result->shards[i].lock);
+                free(result->shards[i].buckets);
+            }
+            free(result->shards);
+            free(result);
+            return BSON_MEMORY_NOT_ALLOCATED;
+        }
+        shard->bucketCount = CACHE_INITIAL_BUCKETS;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    *cache = result;
+    return BSON_OPERATION_SUCCESS;
+}
+
+int BSON_Cache_Lookup(BSON_Cache * cache, const char * file, long offset,
+                      BSON_Cache_Entry ** entry, BSON_Context * context)
+{
+    if(cache == NULL || file == NULL || entry == NULL)
+        return BSON_DOCUMENT_NOT_FOUND;
+
+    unsigned hash = BSON_Cache_Hash(file, offset);
+    BSON_Cache_Shard * shard = BSON_Cache_Get_Shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    BSON_Cache_Entry * found = BSON_Cache_Find(shard, file, offset, hash);
+    if(found == NULL)
+    {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return BSON_DOCUMENT_NOT_FOUND;
+    }
+
+    shard->hits++;
+    found->references++;
+    BSON_Cache_Touch(shard, found);
+    pthread_mutex_unlock(&shard->lock);
+
+    *entry = found;
+    if(context)
+        *context = found->context;
+
+    return BSON_OPERATION_SUCCESS;
+}
+
+int BSON_Cache_Insert(BSON_Cache * cache, const char * file, long offset,
+                      const BSON_Document * document, BSON_Cache_Entry ** entry,
+                      BSON_Context * context)
+{
+    if(cache == NULL || file == NULL || entry == NULL)
+        return BSON_DOCUMENT_NOT_FOUND;
+    if(document == NULL)
+        return BSON_MEMORY_NOT_ALLOCATED;
+
+    /* Проверка документа и выделение памяти выполняются вне блокировки */
+    BSON_Cache_Entry * created = (BSON_Cache_Entry *)calloc(1, sizeof(BSON_Cache_Entry));
+    if(created == NULL)
+        return BSON_MEMORY_NOT_ALLOCATED;
+
+    size_t fileLen = strlen(file) + 1;
+    created->file = (char *)malloc(fileLen);
+    if(created->file == NULL)
+    {
+        free(created);
+        return BSON_MEMORY_NOT_ALLOCATED;
+    }
+    memcpy(created->file, file, fileLen);
+    created->offset = offset;
+    created->hash = BSON_Cache_Hash(file, offset);
+    created->document = *document;
+
+    int initResult = BSON_Init(&created->document, &created->context);
+    if(initResult != BSON_OPERATION_SUCCESS)
+    {
+        BSON_Cache_Free_Entry(created);
+        return initResult;
+    }
+    created->charge = (long)(sizeof(BSON_Cache_Entry) + fileLen) + document->size;
+
+    if(created->charge > cache->budget)
+    {
+        BSON_Cache_Free_Entry(created);
+        return BSON_POS_OUT_OF_RANGE;
+    }
+
+    BSON_Cache_Shard * shard = BSON_Cache_Get_Shard(cache, created->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    BSON_Cache_Entry * found = BSON_Cache_Find(shard, file, offset, created->hash);
+    if(found)
+    {
+        BSON_Cache_Free_Entry(created);
+        BSON_Cache_Touch(shard, found);
+    }
+    else
+    {
+        found = created;
+        if(shard->entries >= shard->bucketCount)
+            BSON_Cache_Grow(shard);
+
+        BSON_Cache_Entry ** bucket = &shard->buckets[found->hash & (shard->bucketCount - 1)];
+        found->nextInBucket = *bucket;
+        *bucket = found;
+        BSON_Cache_Push_LRU(shard, found);
+        found->shard = shard;
+        found->cached = 1;
+        shard->entries++;
+        shard->bytes += found->charge;
+        atomic_fetch_add(&cache->bytes, found->charge);
+        shard->insertions++;
+    }
+    /* Удерживаем элемент до вытеснения, чтобы оно не освободило его память */
+    found->references++;
+    pthread_mutex_unlock(&shard->lock);
+
+    BSON_Cache_Trim(cache, shard, found);
+
+    *entry = found;
+    if(context)
+        *context = found->context;
+
+    return BSON_OPERATION_SUCCESS;
+}
+
+static BSON_Cache_Index * BSON_Cache_Find_Index(BSON_Cache_Entry * entry, const char * path)
+{
+    BSON_Cache_Index * index = entry->index;
+
+    for(; index; index = index->next)
+        if(!strcmp(index->path, path))
+            return index;
+
+    return NULL;
+}
+
+int BSON_Cache_Open(BSON_Cache * cache, BSON_Cache_Entry * entry, const char * path,
+                    BSON_Context * childContext)
+{
+    if(cache == NULL || entry == NULL || path == NULL)
+        return BSON_DOCUMENT_NOT_FOUND;
+    if(childContext == NULL)
+        return BSON_BAD_CONTEXT;
+
+    BSON_Cache_Shard * shard = entry->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    BSON_Cache_Index * index = BSON_Cache_Find_Index(entry, path);
+    if(index)
+        *childContext = index->context;
+    pthread_mutex_unlock(&shard->lock);
+
+    if(index)
+        return BSON_OPERATION_SUCCESS;
+
+    /* Документ только читается, поэтому путь разбирается без блокировки */
+    size_t pathLen = strlen(path) + 1;
+    BSON_Cache_Index * created = (BSON_Cache_Index *)malloc(sizeof(BSON_Cache_Index));
+    if(created == NULL)
+        return BSON_MEMORY_NOT_ALLOCATED;
+    created->path = (char *)malloc(pathLen);
+    char * names = (char *)malloc(pathLen);
+    if(created->path == NULL || names == NULL)
+    {
+        free(created->path);
+        free(names);
+        free(created);
+        return BSON_MEMORY_NOT_ALLOCATED;
+    }
+    memcpy(created->path, path, pathLen);
+    memcpy(names, path, pathLen);
+
+    BSON_Context current = entry->context;
+    char * name = names;
+    int result = BSON_OPERATION_SUCCESS;
+    while(name)
+    {
+        char * dot = strchr(name, '.');
+        if(dot)
+            *dot = '\0';
+
+        BSON_Context child;
+        result = BSON_Open(name, &current, &child);
+        if(result != BSON_OPERATION_SUCCESS)
+            break;
+        current = child;
+        name = dot ? dot + 1 : NULL;
+    }
+    free(names);
+
+    if(result != BSON_OPERATION_SUCCESS)
+    {
+        free(created->path);
+        free(created);
+        return result;
+    }
+    created->context = current;
+
+    int charged = 0;
+    pthread_mutex_lock(&shard->lock);
+    index = BSON_Cache_Find_Index(entry, path);
+    if(index)
+    {
+        free(created->path);
+        free(created);
+    }
+    else
+    {
+        created->next = entry->index;
+        entry->index = created;
+
+        long charge = (long)(sizeof(BSON_Cache_Index) + pathLen);
+        entry->charge += charge;
+        if(entry->cached)
+        {
+            shard->bytes += charge;
+            atomic_fetch_add(&cache->bytes, charge);
+            charged = 1;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if(charged)
+        BSON_Cache_Trim(cache, shard, entry);
+
+    *childContext = current;
+    return BSON_OPERATION_SUCCESS;
+}
+
+int BSON_Cache_Release(BSON_Cache * cache, BSON_Cache_Entry * entry)
+{
+    if(cache == NULL || entry == NULL)
+        return BSON_DOCUMENT_NOT_FOUND;
+
+    BSON_Cache_Shard * shard = entry->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    entry->references--;
+    if(entry->references == 0 && !entry->cached)
+        BSON_Cache_Free_Entry(entry);
+    pthread_mutex_unlock(&shard->lock);
+
+    return BSON_OPERATION_SUCCESS;
+}
+
+int BSON_Cache_Erase(BSON_Cache * cache, const char * file)
+{
+    int i, erased = 0;
+
+    if(cache == NULL || file == NULL)
+        return BSON_DOCUMENT_NOT_FOUND;
+
+    /* Хеш зависит и от смещения, поэтому документы файла есть в любом сегменте */
+    for(i = 0; i < cache->shardCount; ++i)
+    {
+        BSON_Cache_Shard * shard = &cache->shards[i];
+        BSON_Cache_Entry * entry;
+
+        pthread_mutex_lock(&shard->lock);
+        entry = shard->head;
+        while(entry)
+        {
+            BSON_Cache_Entry * next = entry->next;
+            if(!strcmp(entry->file, file))
+            {
+                BSON_Cache_Remove(cache, shard, entry);
+                erased++;
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return erased ? BSON_OPERATION_SUCCESS : BSON_DOCUMENT_NOT_FOUND;
+}
+
+int BSON_Cache_Get_Stats(BSON_Cache * cache, BSON_Cache_Stats * stats)
+{
+    int i;
+
+    if(cache == NULL || stats == NULL)
+        return BSON_DOCUMENT_NOT_FOUND;
+
+    memset(stats, 0, sizeof(BSON_Cache_Stats));
+    stats->budget = cache->budget;
+
+    for(i = 0; i < cache->shardCount; ++i)
+    {
+        BSON_Cache_Shard * shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->insertions += shard->insertions;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return BSON_OPERATION_SUCCESS;
+}
+
+int BSON_Cache_Destroy(BSON_Cache * cache)
+{
+    int i;
+
+    if(cache == NULL)
+        return BSON_DOCUMENT_NOT_FOUND;
+
+    for(i = 0; i < cache->shardCount; ++i)
+    {
+        BSON_Cache_Shard * shard = &cache->shards[i];
+
+        while(shard->tail)
+            BSON_Cache_Remove(cache, shard, shard->tail);
+
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->buckets);
+    }
+
+    free(cache->shards);
+    free(cache);
+
+    return BSON_OPERATION_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/*!
+ *  @header bson_cache.h Кеш открытых документов BSON с ограничением по объему.
+ *
+ *  @discussion Модуль хранит документы, уже прошедшие проверку BSON_Init, вместе с
+ *  контекстами вложенных блоков, найденными через BSON_Cache_Open. Ключом служит пара
+ *  (файл, смещение), вытеснение происходит по принципу LRU. Кеш разбит на сегменты
+ *  со своими блокировками, так что параллельные запросы к разным документам почти не
+ *  конкурируют между собой. Объем кеша общий для всех сегментов: при его превышении
+ *  сначала вытесняются самые старые документы того же сегмента, затем остальных.
+ *
+ *  Кеш не владеет данными документов: память, на которую указывает BSON_Document
+ *  (например, отображенный в память архив), должна оставаться доступной, пока
+ *  документ находится в кеше или удерживается вызывающей стороной.
+ *
+ *  Для работы в нескольких потоках модуль использует pthreads.
+ */
+#ifndef _BSON_CACHE_
+#define _BSON_CACHE_
+
+#include "bson.h"
+
+/*!
+ *  @abstract Кеш документов. Содержимое скрыто от пользователя.
+ */
+typedef struct BSON_Cache_def BSON_Cache;
+
+/*!
+ *  @abstract Документ в кеше. Содержимое скрыто от пользователя.
+ *
+ *  @discussion Пока элемент не освобожден через BSON_Cache_Release, он и все
+ *  полученные из него контексты остаются действительными, даже если кеш его вытеснил.
+ */
+typedef struct BSON_Cache_Entry_def BSON_Cache_Entry;
+
+/*!
+ *  @abstract   Статистика работы кеша.
+ *
+ *  @field hits       Количество попаданий BSON_Cache_Lookup
+ *  @field misses     Количество промахов BSON_Cache_Lookup
+ *  @field insertions Количество документов, добавленных в кеш
+ *  @field evictions  Количество вытесненных документов
+ *  @field entries    Количество документов в кеше
+ *  @field bytes      Объем, занимаемый документами и их контекстами
+ *  @field budget     Максимально допустимый объем
+ */
+typedef struct BSON_Cache_Stats_def
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;
+    long entries;
+    long bytes;
+    long budget;
+} BSON_Cache_Stats;
+
+/*!
+ *  @abstract Создает кеш.
+ *
+ *  @discussion Объем учитывает размер самих документов, имена файлов и сохраненные
+ *  контексты. Объем не делится между сегментами, поэтому в кеш попадает любой
+ *  документ, который помещается в budget целиком.
+ *
+ *  @param budget Максимальный объем кеша в байтах
+ *  @param shards Количество сегментов. Округляется вверх до степени двойки,
+ *  при shards <= 0 выбирается значение по умолчанию
+ *  @param cache  Созданный кеш (выходной параметр)
+ *
+ *  @return BSON_OPERATION_SUCCESS при успехе, BSON_POS_OUT_OF_RANGE, если объем меньше
+ *  размера одного элемента, и BSON_MEMORY_NOT_ALLOCATED, если
+ *  не удалось выделить память
+ */
+int BSON_Cache_Create(long budget, int shards, BSON_Cache ** cache);
+
+/*!
+ *  @abstract Ищет документ в кеше.
+ *
+ *  @discussion При попадании документ становится самым свежим в своем сегменте и
+ *  удерживается до вызова BSON_Cache_Release.
+ *
+ *  @param cache   Кеш
+ *  @param file    Имя файла, из которого взят документ
+ *  @param offset  Смещение документа в файле
+ *  @param entry   Найденный документ (выходной параметр)
+ *  @param context Контекст верхнего уровня документа (выходной параметр).
+ *  Может быть NULL
+ *
+ *  @return BSON_OPERATION_SUCCESS при попадании и BSON_DOCUMENT_NOT_FOUND при промахе
+ */
+int BSON_Cache_Lookup(BSON_Cache * cache, const char * file, long offset,
+                      BSON_Cache_Entry ** entry, BSON_Context * context);
+
+/*!
+ *  @abstract Проверяет документ через BSON_Init и добавляет его в кеш.
+ *
+ *  @discussion Если документ с таким ключом уже есть в кеше (например, его добавил
+ *  другой поток), возвращается он, а переданный документ не используется. Как и
+ *  BSON_Cache_Lookup, удерживает документ до вызова BSON_Cache_Release.
+ *
+ *  @param cache    Кеш
+ *  @param file     Имя файла, из которого взят документ
+ *  @param offset   Смещение документа в файле
+ *  @param document Документ. Сама структура копируется, данные — нет
+ *  @param entry    Документ в кеше (выходной параметр)
+ *  @param context  Контекст верхнего уровня документа (выходной параметр).
+ *  Может быть NULL
+ *
+ *  @return BSON_OPERATION_SUCCESS при успехе, коды ошибок BSON_Init для
+ *  неправильного документа, BSON_POS_OUT_OF_RANGE, если документ больше всего
+ *  объема кеша, и BSON_MEMORY_NOT_ALLOCATED, если не удалось выделить память
+ */
+int BSON_Cache_Insert(BSON_Cache * cache, const char * file, long offset,
+                      const BSON_Document * document, BSON_Cache_Entry ** entry,
+                      BSON_Context * context);
+
+/*!
+ *  @abstract Открывает вложенный документ или массив по пути от верхнего уровня.
+ *
+ *  @discussion Путь состоит из имен, разделенных точкой, например "event.param".
+ *  Каждая часть пути открывается через BSON_Open. Результат запоминается в кеше,
+ *  поэтому повторные вызовы с тем же путем не просматривают документ заново.
+ *
+ *  @param cache        Кеш
+ *  @param entry        Документ, полученный из BSON_Cache_Lookup или BSON_Cache_Insert
+ *  @param path         Путь к блоку
+ *  @param childContext Контекст найденного блока (выходной параметр)
+ *
+ *  @return BSON_OPERATION_SUCCESS при успехе, коды ошибок BSON_Open, если блок не
+ *  найден, и BSON_MEMORY_NOT_ALLOCATED, если не удалось выделить память
+ */
+int BSON_Cache_Open(BSON_Cache * cache, BSON_Cache_Entry * entry, const char * path,
+                    BSON_Context * childContext);
+
+/*!
+ *  @abstract Освобождает документ, полученный из BSON_Cache_Lookup или BSON_Cache_Insert.
+ *
+ *  @discussion После вызова документ и его контексты использовать нельзя.
+ *
+ *  @return BSON_OPERATION_SUCCESS при успехе и BSON_DOCUMENT_NOT_FOUND, если entry
+ *  равен NULL
+ */
+int BSON_Cache_Release(BSON_Cache * cache, BSON_Cache_Entry * entry);
+
+/*!
+ *  @abstract Удаляет из кеша все документы указанного файла.
+ *
+ *  @discussion Нужна перед тем, как отобразить файл заново или освободить его память.
+ *  Удаленные документы, которые еще удерживаются, остаются действительными до вызова
+ *  BSON_Cache_Release, как и при вытеснении, поэтому память файла можно освобождать
+ *  только после того, как все они освобождены. Удаление не считается вытеснением в
+ *  статистике.
+ *
+ *  @param cache Кеш
+ *  @param file  Имя файла
+ *
+ *  @return BSON_OPERATION_SUCCESS, если удален хотя бы один документ, и
+ *  BSON_DOCUMENT_NOT_FOUND, если документов этого файла в кеше не было
+ */
+int BSON_Cache_Erase(BSON_Cache * cache, const char * file);
+
+/*!
+ *  @abstract Собирает статистику по всем сегментам кеша.
+ *
+ *  @param cache Кеш
+ *  @param stats Статистика (выходной параметр)
+ *
+ *  @return BSON_OPERATION_SUCCESS при успехе и BSON_DOCUMENT_NOT_FOUND, если cache
+ *  равен NULL
+ */
+int BSON_Cache_Get_Stats(BSON_Cache * cache, BSON_Cache_Stats * stats);
+
+/*!
+ *  @abstract Уничтожает кеш.
+ *
+ *  @discussion К моменту вызова все документы должны быть освобождены через
+ *  BSON_Cache_Release. Данные самих документов не освобождаются.
+ *
+ *  @return BSON_OPERATION_SUCCESS при успехе и BSON_DOCUMENT_NOT_FOUND, если cache
+ *  равен NULL
+ */
+int BSON_Cache_Destroy(BSON_Cache * cache);
+
+#endif
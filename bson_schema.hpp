@@ -0,0 +1,443 @@
+/*!
+ *  @header bson_schema.hpp Специализированный под схему декодер документов BSON для C++.
+ *
+ *  @discussion Заголовочный модуль поверх bson.h. Структура и constexpr-список описаний
+ *  её полей порождают декодер, который заполняет всю структуру за один проход по
+ *  контексту. Длины и хеши имён полей вычисляются на этапе компиляции, поэтому при
+ *  разборе не используются strlen и повторные вызовы BSON_Fetch. Декодер работает с
+ *  обычными BSON_Context и возвращает коды из BSON_ERROR, так что его можно смешивать
+ *  с функциями BSON_Extract_* и BSON_Open. Требуется C++14.
+ *
+ *  Пример для события из main.c:
+ *
+ *  <pre>
+ *  struct Event { int type, source, severity; char * message; BSON_Context param; };
+ *
+ *  constexpr auto eventSchema = BSON::Make_Schema<Event>(
+ *      BSON_FIELD("type",     &Event::type),
+ *      BSON_FIELD("source",   &Event::source),
+ *      BSON_FIELD("severity", &Event::severity),
+ *      BSON_FIELD("message",  &Event::message),
+ *      BSON_FIELD_AS(BSON::ARRAY, "param", &Event::param));
+ *
+ *  Event event = {};
+ *  int result = eventSchema.Decode(&eventContext, &event);
+ *  </pre>
+ */
+#ifndef _BSON_SCHEMA_
+#define _BSON_SCHEMA_
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+extern "C"
+{
+#include "bson.h"
+}
+
+namespace BSON
+{
+
+/*!
+ *  @enum Element_Type Типы элементов BSON, которые умеет заполнять декодер.
+ */
+enum Element_Type : byte
+{
+    DOUBLE   = 0x01,
+    STRING   = 0x02,
+    DOCUMENT = 0x03,
+    ARRAY    = 0x04,
+    BINARY   = 0x05,
+    BOOLEAN  = 0x08,
+    DATETIME = 0x09,
+    INT32    = 0x10,
+    INT64    = 0x12
+};
+
+/*!
+ *  @abstract Хеш FNV-1a имени поля. Вычисляется на этапе компиляции для описаний полей
+ *  и тем же способом во время разбора, одновременно с поиском конца имени.
+ */
+constexpr unsigned FNV_OFFSET = 2166136261u;
+constexpr unsigned FNV_PRIME  = 16777619u;
+
+constexpr unsigned Key_Hash(const char * key, int length)
+{
+    unsigned hash = FNV_OFFSET;
+    for(int i = 0; i < length; ++i)
+        hash = (hash ^ (byte)key[i]) * FNV_PRIME;
+    return hash;
+}
+
+/*!
+ *  @abstract Длина имени поля без завершающего нуля. Принимает только массивы, чтобы
+ *  в BSON_FIELD нельзя было случайно передать указатель вместо строкового литерала.
+ */
+template <std::size_t N>
+constexpr int Key_Length(const char (&)[N])
+{
+    return (int)N - 1;
+}
+
+/*!
+ *  @abstract Тип BSON, соответствующий типу поля структуры по умолчанию.
+ *
+ *  @discussion Для time_t, который обычно совпадает с long, и для вложенных массивов
+ *  тип нужно указывать явно через BSON_FIELD_AS.
+ */
+template <typename M> struct Default_Type;
+template <> struct Default_Type<double>       { static constexpr byte value = DOUBLE;   };
+template <> struct Default_Type<char *>       { static constexpr byte value = STRING;   };
+template <> struct Default_Type<BSON_Context> { static constexpr byte value = DOCUMENT; };
+template <> struct Default_Type<byte *>       { static constexpr byte value = BINARY;   };
+template <> struct Default_Type<byte>         { static constexpr byte value = BOOLEAN;  };
+template <> struct Default_Type<int>          { static constexpr byte value = INT32;    };
+template <> struct Default_Type<long>         { static constexpr byte value = INT64;    };
+
+template <typename P> struct Member_Default_Type;
+template <typename T, typename M>
+struct Member_Default_Type<M T::*> : Default_Type<M> {};
+
+/*!
+ *  @abstract   Описание одного поля схемы.
+ *
+ *  @discussion Тип BSON, хеш и длина имени и указатель на поле структуры являются
+ *  параметрами шаблона, поэтому при разборе сравниваются с константами. Создается
+ *  макросами BSON_FIELD и BSON_FIELD_AS.
+ *
+ *  @field key Имя поля в документе, используется только для проверки при совпадении хеша
+ */
+template <byte Type, unsigned Hash, int Length, typename P, P Member>
+struct Field_Descriptor;
+
+template <byte Type, unsigned Hash, int Length, typename T, typename M, M T::* Member>
+struct Field_Descriptor<Type, Hash, Length, M T::*, Member>
+{
+    static constexpr byte type = Type;
+    static constexpr unsigned hash = Hash;
+    static constexpr int length = Length;
+    typedef T record_type;
+
+    static M & Get(T * record)
+    {
+        return record->*Member;
+    }
+
+    const char * key;
+};
+
+/*!
+ *  @abstract Описание поля с явно заданным типом BSON.
+ *
+ *  @param type   Тип элемента из Element_Type
+ *  @param key    Имя поля, строковый литерал
+ *  @param member Указатель на поле структуры, например &Event::type
+ */
+#define BSON_FIELD_AS(type, key, member)                                             \
+    ::BSON::Field_Descriptor<(type), ::BSON::Key_Hash(key, ::BSON::Key_Length(key)), \
+                             ::BSON::Key_Length(key), decltype(member), (member)>{key}
+
+/*!
+ *  @abstract Описание поля, тип BSON которого выводится из типа поля структуры.
+ */
+#define BSON_FIELD(key, member) \
+    BSON_FIELD_AS(::BSON::Member_Default_Type<decltype(member)>::value, key, member)
+
+namespace Detail
+{
+
+inline int Read_Int32(const byte * src)
+{
+    int value;
+    memcpy(&value, src, sizeof(int));
+    return value;
+}
+
+/*!
+ *  @abstract Вычисляет размер значения элемента по его заголовочному байту.
+ *
+ *  @return Размер значения в байтах или -1 для неизвестного типа
+ */
+inline long Value_Size(byte type, const byte * value, const byte * end)
+{
+    switch(type)
+    {
+        case 0x01: case 0x09: case 0x11: case 0x12:
+            return 8;
+        case 0x02: case 0x0D: case 0x0E:
+            return end - value < 4 ? -1 : 4 + (long)Read_Int32(value);
+        case 0x03: case 0x04: case 0x0F:
+            return end - value < 4 ? -1 : (long)Read_Int32(value);
+        case 0x05:
+            return end - value < 4 ? -1 : 4 + 1 + (long)Read_Int32(value);
+        case 0x06: case 0x0A: case 0x7F: case 0xFF:
+            return 0;
+        case 0x07:
+            return 12;
+        case 0x08:
+            return 1;
+        case 0x0B:
+        {
+            /* Регулярное выражение: шаблон и флаги, две строки с завершающим нулем */
+            const byte * pattern = (const byte *)memchr(value, 0x0, end - value);
+            if(pattern == NULL)
+                return -1;
+            const byte * flags = (const byte *)memchr(pattern + 1, 0x0, end - pattern - 1);
+            return flags == NULL ? -1 : flags + 1 - value;
+        }
+        case 0x0C:
+            /* DBPointer: строка и ObjectId */
+            return end - value < 4 ? -1 : 4 + (long)Read_Int32(value) + 12;
+        case 0x10:
+            return 4;
+        case 0x13:
+            return 16;
+        default:
+            return -1;
+    }
+}
+
+/*
+ *  Чтение значения в поле структуры. Тип BSON известен на этапе компиляции, поэтому
+ *  каждый вызов сводится к одной ветке; сочетания типа BSON и типа поля, для которых
+ *  нет перегрузки, не компилируются.
+ */
+template <byte Type> struct Reader;
+
+template <> struct Reader<DOUBLE>
+{
+    static int Read(const byte * value, long, const BSON_Context *, double & out)
+    {
+        memcpy(&out, value, sizeof(double));
+        return BSON_OPERATION_SUCCESS;
+    }
+};
+
+template <> struct Reader<INT32>
+{
+    static int Read(const byte * value, long, const BSON_Context *, int & out)
+    {
+        out = Read_Int32(value);
+        return BSON_OPERATION_SUCCESS;
+    }
+};
+
+template <> struct Reader<INT64>
+{
+    template <typename M>
+    static int Read(const byte * value, long, const BSON_Context *, M & out)
+    {
+        static_assert(std::is_integral<M>::value && sizeof(M) == 8,
+                      "int64 and datetime fields require an 8-byte integer member");
+        memcpy(&out, value, sizeof(M));
+        return BSON_OPERATION_SUCCESS;
+    }
+};
+
+template <> struct Reader<DATETIME> : Reader<INT64> {};
+
+template <> struct Reader<BOOLEAN>
+{
+    static int Read(const byte * value, long, const BSON_Context *, byte & out)
+    {
+        out = *value;
+        return BSON_OPERATION_SUCCESS;
+    }
+};
+
+/* Строки и двоичные данные выделяются так же, как в BSON_Extract_String/Binary */
+template <> struct Reader<STRING>
+{
+    static int Read(const byte * value, long size, const BSON_Context *, char *& out)
+    {
+        int strSize = Read_Int32(value);
+        if(strSize <= 0 || strSize != size - 4 || value[size - 1] != 0x0)
+            return BSON_MEMORY_CORRUPTED;
+
+        char * result = (char *)realloc(out, sizeof(char) * strSize);
+        if(result == NULL)
+            return BSON_MEMORY_NOT_ALLOCATED;
+
+        memcpy(result, value + 4, strSize);
+        out = result;
+        return BSON_OPERATION_SUCCESS;
+    }
+};
+
+template <> struct Reader<BINARY>
+{
+    static int Read(const byte * value, long, const BSON_Context *, byte *& out)
+    {
+        int binSize = Read_Int32(value);
+        if(binSize < 0)
+            return BSON_MEMORY_CORRUPTED;
+
+        byte * result = (byte *)realloc(out, sizeof(byte) * binSize);
+        if(result == NULL && binSize != 0)
+            return BSON_MEMORY_NOT_ALLOCATED;
+
+        memcpy(result, value + 4 + 1, binSize);
+        out = result;
+        return BSON_OPERATION_SUCCESS;
+    }
+};
+
+/* Вложенный документ открывается так же, как это делает BSON_Open */
+template <> struct Reader<DOCUMENT>
+{
+    static int Read(const byte * value, long size, const BSON_Context * parent,
+                    BSON_Context & out)
+    {
+        if(size < 5 || value[size - 1] != 0x0)
+            return BSON_MEMORY_CORRUPTED;
+
+        out.document = parent->document;
+        out.startPosition = out.position = (byte *)value + 4;
+        out.size = size;
+        return BSON_OPERATION_SUCCESS;
+    }
+};
+
+template <> struct Reader<ARRAY> : Reader<DOCUMENT> {};
+
+} /* namespace Detail */
+
+/*!
+ *  @abstract Декодер документа в структуру T по списку описаний полей.
+ *
+ *  @discussion Создается через Make_Schema. Поддерживается до 64 полей.
+ */
+template <typename T, typename... Fields>
+class Schema
+{
+public:
+    constexpr explicit Schema(Fields... fields) : fields_(fields...) {}
+
+    /*!
+     *  @abstract Заполняет структуру значениями из контекста за один проход.
+     *
+     *  @discussion Разбор идет с начала контекста, позиция контекста не меняется.
+     *  Элементы с неизвестными именами пропускаются, как и элементы, имя которых
+     *  совпало с полем схемы, а тип — нет. При повторе имени используется первый
+     *  подходящий элемент, как в BSON_Fetch. Разбор заканчивается, как только
+     *  заполнены все поля схемы, поэтому повреждения в оставшейся части документа не
+     *  обнаруживаются — так же, как при последовательных вызовах BSON_Extract_*.
+     *
+     *  @param context Контекст документа, полученный из BSON_Init или BSON_Open
+     *  @param record  Заполняемая структура (выходной параметр)
+     *
+     *  @return BSON_OPERATION_SUCCESS, если найдены все поля схемы,
+     *  BSON_POS_OUT_OF_RANGE, если какое-то поле не найдено, BSON_BAD_CONTEXT при
+     *  ошибках в контексте, BSON_MEMORY_CORRUPTED при нарушении структуры документа и
+     *  BSON_MEMORY_NOT_ALLOCATED, если не удалось выделить память под строку.
+     */
+    int Decode(const BSON_Context * context, T * record) const
+    {
+        if(BSON_Check_Context(context) == BSON_BAD_CONTEXT || record == NULL)
+            return BSON_BAD_CONTEXT;
+        if(context->size < 5)
+            return BSON_MEMORY_CORRUPTED;
+
+        const byte * currentPos = context->startPosition;
+        /* Завершающий ноль контекста стоит на месте size - 5, см. BSON_Open */
+        const byte * end = context->startPosition + context->size - 5;
+        unsigned long long found = 0;
+
+        while(currentPos < end)
+        {
+            byte headerByte = *currentPos;
+            const byte * key = currentPos + 1;
+            /* Длина и хеш имени вычисляются за один проход по нему */
+            const byte * keyEnd = key;
+            unsigned hash = FNV_OFFSET;
+            while(keyEnd < end && *keyEnd != 0x0)
+            {
+                hash = (hash ^ *keyEnd) * FNV_PRIME;
+                ++keyEnd;
+            }
+            if(keyEnd >= end)
+                return BSON_MEMORY_CORRUPTED;
+
+            const byte * value = keyEnd + 1;
+            long size = Detail::Value_Size(headerByte, value, end);
+            if(size < 0 || size > end - value)
+                return BSON_MEMORY_CORRUPTED;
+
+            int result = Dispatch(std::integral_constant<std::size_t, 0>(), headerByte,
+                                  hash, (int)(keyEnd - key), key, value, size, context,
+                                  record, found);
+            if(result != BSON_OPERATION_SUCCESS)
+                return result;
+
+            if(found == All_Fields())
+                return BSON_OPERATION_SUCCESS;
+
+            currentPos = value + size;
+        }
+
+        return found == All_Fields() ? BSON_OPERATION_SUCCESS : BSON_POS_OUT_OF_RANGE;
+    }
+
+private:
+    static_assert(sizeof...(Fields) <= 64, "schema supports at most 64 fields");
+
+    static constexpr unsigned long long All_Fields()
+    {
+        return sizeof...(Fields) == 64 ? ~0ull : (1ull << sizeof...(Fields)) - 1;
+    }
+
+    /*
+     *  Сравнение с полями разворачивается в цепочку сравнений с константами из
+     *  параметров Field_Descriptor: тип, длина и хеш имени. Только при их совпадении
+     *  имя сверяется через memcmp фиксированной длины для защиты от коллизий.
+     */
+    template <std::size_t I>
+    int Dispatch(std::integral_constant<std::size_t, I>, byte type, unsigned hash,
+                 int length, const byte * key, const byte * value, long size,
+                 const BSON_Context * context, T * record,
+                 unsigned long long & found) const
+    {
+        typedef typename std::tuple_element<I, std::tuple<Fields...> >::type Descriptor;
+        const Descriptor & field = std::get<I>(fields_);
+        const unsigned long long bit = 1ull << I;
+
+        if(type == Descriptor::type && length == Descriptor::length &&
+           hash == Descriptor::hash && !(found & bit) &&
+           !memcmp(key, field.key, Descriptor::length))
+        {
+            int result = Detail::Reader<Descriptor::type>::Read(value, size, context,
+                                                                Descriptor::Get(record));
+            if(result == BSON_OPERATION_SUCCESS)
+                found |= bit;
+            return result;
+        }
+
+        return Dispatch(std::integral_constant<std::size_t, I + 1>(), type, hash, length,
+                        key, value, size, context, record, found);
+    }
+
+    int Dispatch(std::integral_constant<std::size_t, sizeof...(Fields)>, byte, unsigned,
+                 int, const byte *, const byte *, long, const BSON_Context *, T *,
+                 unsigned long long &) const
+    {
+        return BSON_OPERATION_SUCCESS;
+    }
+
+    std::tuple<Fields...> fields_;
+};
+
+/*!
+ *  @abstract Собирает схему структуры T из описаний полей, созданных BSON_FIELD и
+ *  BSON_FIELD_AS.
+ */
+template <typename T, typename... Fields>
+constexpr Schema<T, Fields...> Make_Schema(Fields... fields)
+{
+    return Schema<T, Fields...>(fields...);
+}
+
+} /* namespace BSON */
+
+#endif
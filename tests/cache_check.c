@@ -0,0 +1,264 @@
+/*
+ *  Проверка кеша документов из bson_cache.h: статистика, вытеснение удерживаемого
+ *  документа, общий для сегментов объем, удаление файла, запомненные контексты и
+ *  одновременное добавление одного и того же документа из нескольких потоков.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bson_cache.h"
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if(!(condition))                                                        \
+        {                                                                       \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return EXIT_FAILURE;                                                \
+        }                                                                       \
+    } while(0)
+
+#define DOC_SIZE 1000
+#define THREADS  8
+
+static void Write_Key(byte ** pos, byte type, const char * name)
+{
+    size_t len = strlen(name) + 1;
+    **pos = type;
+    memcpy(*pos + 1, name, len);
+    *pos += 1 + len;
+}
+
+static void Write_Int32(byte ** pos, int value)
+{
+    memcpy(*pos, &value, sizeof(int));
+    *pos += sizeof(int);
+}
+
+/*
+ *  Документ заданного размера (не меньше 56 байт):
+ *  { type: value, event: { param: [ value ] }, pad: "..." }
+ */
+static void Make_Document(byte * data, int size, int value)
+{
+    byte * pos = data;
+
+    Write_Int32(&pos, size);
+    Write_Key(&pos, 0x10, "type");
+    Write_Int32(&pos, value);
+
+    Write_Key(&pos, 0x03, "event");
+    Write_Int32(&pos, 24);
+    Write_Key(&pos, 0x04, "param");
+    Write_Int32(&pos, 12);
+    Write_Key(&pos, 0x10, "0");
+    Write_Int32(&pos, value);
+    *pos++ = 0x0;
+    *pos++ = 0x0;
+
+    int padLen = size - (int)(pos - data) - 9 - 1;
+    Write_Key(&pos, 0x02, "pad");
+    Write_Int32(&pos, padLen);
+    memset(pos, 'x', padLen - 1);
+    pos[padLen - 1] = 0x0;
+    pos += padLen;
+    *pos = 0x0;
+}
+
+static byte documents[8][DOC_SIZE];
+
+static BSON_Document Get_Document(int i)
+{
+    BSON_Document doc;
+    doc.data = documents[i];
+    doc.size = DOC_SIZE;
+    return doc;
+}
+
+static int Check_Stats_And_Eviction(void)
+{
+    BSON_Cache * cache;
+    BSON_Cache_Entry * entry, * held;
+    BSON_Cache_Stats stats;
+    BSON_Context ctx;
+    BSON_Document doc;
+    int i, value;
+
+    /* Помещаются ровно два документа */
+    CHECK(BSON_Cache_Create(2 * DOC_SIZE + 400, 1, &cache) == BSON_OPERATION_SUCCESS);
+
+    CHECK(BSON_Cache_Lookup(cache, "a", 0, &entry, &ctx) == BSON_DOCUMENT_NOT_FOUND);
+    doc = Get_Document(0);
+    CHECK(BSON_Cache_Insert(cache, "a", 0, &doc, &held, &ctx) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Lookup(cache, "a", 0, &entry, NULL) == BSON_OPERATION_SUCCESS);
+    CHECK(entry == held);
+    CHECK(BSON_Cache_Release(cache, entry) == BSON_OPERATION_SUCCESS);
+
+    /* "a" остается удерживаемым и становится самым старым */
+    for(i = 1; i <= 2; ++i)
+    {
+        doc = Get_Document(i);
+        CHECK(BSON_Cache_Insert(cache, "b", i, &doc, &entry, NULL) == 0);
+        CHECK(BSON_Cache_Release(cache, entry) == 0);
+    }
+
+    CHECK(BSON_Cache_Get_Stats(cache, &stats) == BSON_OPERATION_SUCCESS);
+    CHECK(stats.hits == 1 && stats.misses == 1);
+    CHECK(stats.insertions == 3 && stats.evictions == 1);
+    CHECK(stats.entries == 2 && stats.bytes <= stats.budget);
+
+    /* Вытесненный документ еще удерживается, его контексты действительны */
+    CHECK(BSON_Cache_Lookup(cache, "a", 0, &entry, NULL) == BSON_DOCUMENT_NOT_FOUND);
+    CHECK(BSON_Extract_Int32("type", &ctx, &value) == BSON_OPERATION_SUCCESS);
+    CHECK(value == 0);
+    BSON_Context param;
+    CHECK(BSON_Cache_Open(cache, held, "event.param", &param) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Extract_Int32(NULL, &param, &value) == 0 && value == 0);
+    CHECK(BSON_Cache_Release(cache, held) == BSON_OPERATION_SUCCESS);
+
+    CHECK(BSON_Cache_Get_Stats(cache, &stats) == 0);
+    CHECK(stats.entries == 2 && stats.bytes <= stats.budget);
+
+    CHECK(BSON_Cache_Destroy(cache) == BSON_OPERATION_SUCCESS);
+    return EXIT_SUCCESS;
+}
+
+static int Check_Budget(void)
+{
+    BSON_Cache * cache;
+    BSON_Cache_Entry * entry;
+    BSON_Cache_Stats stats;
+    BSON_Document doc = Get_Document(0);
+
+    CHECK(BSON_Cache_Create(16, 0, &cache) == BSON_POS_OUT_OF_RANGE);
+
+    /* Документ больше budget / shards все равно попадает в кеш */
+    CHECK(BSON_Cache_Create(DOC_SIZE + 400, 16, &cache) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Insert(cache, "a", 0, &doc, &entry, NULL) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Release(cache, entry) == 0);
+    CHECK(BSON_Cache_Get_Stats(cache, &stats) == 0);
+    CHECK(stats.entries == 1 && stats.bytes <= stats.budget);
+    CHECK(BSON_Cache_Destroy(cache) == 0);
+
+    /* Документ больше всего объема не попадает */
+    CHECK(BSON_Cache_Create(DOC_SIZE / 2, 1, &cache) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Insert(cache, "a", 0, &doc, &entry, NULL) == BSON_POS_OUT_OF_RANGE);
+    CHECK(BSON_Cache_Destroy(cache) == 0);
+
+    return EXIT_SUCCESS;
+}
+
+static int Check_Index_And_Erase(void)
+{
+    BSON_Cache * cache;
+    BSON_Cache_Entry * entry;
+    BSON_Cache_Stats before, after;
+    BSON_Context first, second;
+    BSON_Document doc;
+    int i;
+
+    CHECK(BSON_Cache_Create(16 * DOC_SIZE, 4, &cache) == BSON_OPERATION_SUCCESS);
+    for(i = 0; i < 4; ++i)
+    {
+        doc = Get_Document(i);
+        CHECK(BSON_Cache_Insert(cache, "a", i, &doc, &entry, NULL) == 0);
+        CHECK(BSON_Cache_Release(cache, entry) == 0);
+    }
+    doc = Get_Document(4);
+    CHECK(BSON_Cache_Insert(cache, "b", 0, &doc, &entry, NULL) == 0);
+
+    /* Повторное открытие пути берется из запомненных контекстов */
+    CHECK(BSON_Cache_Open(cache, entry, "event.param", &first) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Get_Stats(cache, &before) == 0);
+    CHECK(BSON_Cache_Open(cache, entry, "event.param", &second) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Get_Stats(cache, &after) == 0);
+    CHECK(first.startPosition == second.startPosition && first.size == second.size);
+    CHECK(before.bytes == after.bytes);
+    CHECK(BSON_Cache_Open(cache, entry, "event.missing", &second) != BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Release(cache, entry) == 0);
+
+    CHECK(BSON_Cache_Erase(cache, "a") == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Erase(cache, "a") == BSON_DOCUMENT_NOT_FOUND);
+    for(i = 0; i < 4; ++i)
+        CHECK(BSON_Cache_Lookup(cache, "a", i, &entry, NULL) == BSON_DOCUMENT_NOT_FOUND);
+    CHECK(BSON_Cache_Lookup(cache, "b", 0, &entry, NULL) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Cache_Release(cache, entry) == 0);
+
+    CHECK(BSON_Cache_Get_Stats(cache, &after) == 0);
+    CHECK(after.entries == 1 && after.evictions == 0);
+
+    CHECK(BSON_Cache_Destroy(cache) == 0);
+    return EXIT_SUCCESS;
+}
+
+typedef struct Insert_Job_def
+{
+    BSON_Cache * cache;
+    pthread_barrier_t * barrier;
+    BSON_Cache_Entry * entry;
+    int result;
+} Insert_Job;
+
+static void * Insert_Same_Key(void * arg)
+{
+    Insert_Job * job = (Insert_Job *)arg;
+    BSON_Document doc = Get_Document(5);
+
+    pthread_barrier_wait(job->barrier);
+    job->result = BSON_Cache_Insert(job->cache, "shared", 42, &doc, &job->entry, NULL);
+    return NULL;
+}
+
+static int Check_Concurrent_Insert(void)
+{
+    BSON_Cache * cache;
+    BSON_Cache_Stats stats;
+    pthread_barrier_t barrier;
+    pthread_t threads[THREADS];
+    Insert_Job jobs[THREADS];
+    int i;
+
+    CHECK(BSON_Cache_Create(4 * DOC_SIZE, 4, &cache) == BSON_OPERATION_SUCCESS);
+    pthread_barrier_init(&barrier, NULL, THREADS);
+
+    for(i = 0; i < THREADS; ++i)
+    {
+        jobs[i].cache = cache;
+        jobs[i].barrier = &barrier;
+        pthread_create(&threads[i], NULL, Insert_Same_Key, &jobs[i]);
+    }
+    for(i = 0; i < THREADS; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    /* Все потоки получили один и тот же элемент */
+    for(i = 0; i < THREADS; ++i)
+    {
+        CHECK(jobs[i].result == BSON_OPERATION_SUCCESS);
+        CHECK(jobs[i].entry == jobs[0].entry);
+    }
+
+    CHECK(BSON_Cache_Get_Stats(cache, &stats) == 0);
+    CHECK(stats.insertions == 1 && stats.entries == 1);
+
+    for(i = 0; i < THREADS; ++i)
+        CHECK(BSON_Cache_Release(cache, jobs[i].entry) == 0);
+
+    CHECK(BSON_Cache_Destroy(cache) == 0);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    int i;
+
+    for(i = 0; i < 8; ++i)
+        Make_Document(documents[i], DOC_SIZE, i);
+
+    if(Check_Stats_And_Eviction() || Check_Budget() || Check_Index_And_Erase() ||
+       Check_Concurrent_Insert())
+        return EXIT_FAILURE;
+
+    printf("cache_check: OK\n");
+    return EXIT_SUCCESS;
+}
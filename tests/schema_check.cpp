@@ -0,0 +1,229 @@
+/*
+ *  Проверка декодера из bson_schema.hpp на событии из main.c и на поврежденных
+ *  документах. Результат декодера сравнивается с функциями BSON_Extract_*.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "bson_schema.hpp"
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if(!(condition))                                                        \
+        {                                                                       \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return EXIT_FAILURE;                                                \
+        }                                                                       \
+    } while(0)
+
+struct Event
+{
+    int type, source, severity;
+    char * message;
+    BSON_Context param;
+};
+
+struct Param
+{
+    int num, type;
+};
+
+constexpr auto eventSchema = BSON::Make_Schema<Event>(
+    BSON_FIELD("type",     &Event::type),
+    BSON_FIELD("source",   &Event::source),
+    BSON_FIELD("severity", &Event::severity),
+    BSON_FIELD("message",  &Event::message),
+    BSON_FIELD_AS(BSON::ARRAY, "param", &Event::param));
+
+constexpr auto paramSchema = BSON::Make_Schema<Param>(
+    BSON_FIELD("num",  &Param::num),
+    BSON_FIELD("type", &Param::type));
+
+/* Построение документов BSON вручную */
+class Builder
+{
+public:
+    void Int32(int value)
+    {
+        data.insert(data.end(), (byte *)&value, (byte *)&value + sizeof(int));
+    }
+
+    void Key(byte type, const char * name)
+    {
+        data.push_back(type);
+        data.insert(data.end(), name, name + strlen(name) + 1);
+    }
+
+    void Int32(const char * name, int value)
+    {
+        Key(BSON::INT32, name);
+        Int32(value);
+    }
+
+    void String(const char * name, const char * value)
+    {
+        Key(BSON::STRING, name);
+        Int32((int)strlen(value) + 1);
+        data.insert(data.end(), value, value + strlen(value) + 1);
+    }
+
+    /* Начинает документ и возвращает позицию его размера для End */
+    size_t Begin(byte type = 0, const char * name = NULL)
+    {
+        if(name)
+            Key(type, name);
+        size_t start = data.size();
+        Int32(0);
+        return start;
+    }
+
+    void End(size_t start)
+    {
+        data.push_back(0x0);
+        int size = (int)(data.size() - start);
+        memcpy(&data[start], &size, sizeof(int));
+    }
+
+    std::vector<byte> data;
+};
+
+/* Событие из main.c: { event: { type, source, severity, message, param: [...] } } */
+static std::vector<byte> Build_Event()
+{
+    Builder b;
+    size_t top = b.Begin();
+    size_t event = b.Begin(BSON::DOCUMENT, "event");
+    b.Int32("type", 1);
+    b.Int32("source", 2);
+    b.Int32("severity", 3);
+    b.String("message", "disk is almost full");
+    size_t param = b.Begin(BSON::ARRAY, "param");
+    for(int i = 0; i < 3; ++i)
+    {
+        char index[2] = {(char)('0' + i), 0};
+        size_t item = b.Begin(BSON::DOCUMENT, index);
+        b.Int32("num", i);
+        b.Int32("type", i + 2);
+        if(i + 2 == 3)
+            b.String("value", "sda1");
+        b.End(item);
+    }
+    b.End(param);
+    b.End(event);
+    b.End(top);
+    return b.data;
+}
+
+static int Check_Event()
+{
+    std::vector<byte> data = Build_Event();
+    BSON_Document doc;
+    doc.data = data.data();
+    doc.size = (long)data.size();
+
+    BSON_Context ctx, eventContext;
+    CHECK(BSON_Init(&doc, &ctx) == BSON_OPERATION_SUCCESS);
+    CHECK(BSON_Open(NULL, &ctx, &eventContext) == BSON_OPERATION_SUCCESS);
+
+    Event event = {};
+    CHECK(eventSchema.Decode(&eventContext, &event) == BSON_OPERATION_SUCCESS);
+
+    /* Те же значения через C API, как в main.c */
+    BSON_Context extractContext = eventContext;
+    int type, source, severity;
+    char * message = NULL;
+    CHECK(BSON_Extract_Int32((char *)"type", &extractContext, &type) == 0);
+    CHECK(BSON_Extract_Int32((char *)"source", &extractContext, &source) == 0);
+    CHECK(BSON_Extract_Int32((char *)"severity", &extractContext, &severity) == 0);
+    CHECK(BSON_Extract_String(NULL, &extractContext, &message) == 0);
+
+    CHECK(event.type == type && event.source == source && event.severity == severity);
+    CHECK(!strcmp(event.message, message));
+
+    BSON_Context paramContext;
+    CHECK(BSON_Open((char *)"param", &eventContext, &paramContext) == 0);
+    CHECK(paramContext.startPosition == event.param.startPosition);
+    CHECK(paramContext.size == event.param.size);
+
+    for(int i = 0; i < 3; ++i)
+    {
+        BSON_Context inCtx;
+        Param p;
+        CHECK(BSON_Open(NULL, &event.param, &inCtx) == BSON_OPERATION_SUCCESS);
+        CHECK(paramSchema.Decode(&inCtx, &p) == BSON_OPERATION_SUCCESS);
+        CHECK(p.num == i && p.type == i + 2);
+        BSON_Fetch(NULL, &event.param);
+    }
+
+    free(message);
+    free(event.message);
+    return EXIT_SUCCESS;
+}
+
+static int Check_Malformed()
+{
+    /* Длина строки выходит за пределы документа */
+    Builder b;
+    size_t top = b.Begin();
+    b.Key(BSON::STRING, "message");
+    b.Int32(1000);
+    b.data.push_back('x');
+    b.data.push_back(0x0);
+    b.Int32("type", 1);
+    b.End(top);
+
+    BSON_Document doc;
+    doc.data = b.data.data();
+    doc.size = (long)b.data.size();
+    BSON_Context ctx;
+    CHECK(BSON_Init(&doc, &ctx) == BSON_OPERATION_SUCCESS);
+
+    Event event = {};
+    CHECK(eventSchema.Decode(&ctx, &event) == BSON_MEMORY_CORRUPTED);
+    free(event.message);
+
+    /* Неизвестный заголовочный байт */
+    b.data[4] = 0x42;
+    Param p;
+    CHECK(paramSchema.Decode(&ctx, &p) == BSON_MEMORY_CORRUPTED);
+
+    return EXIT_SUCCESS;
+}
+
+static int Check_Skipped_Types()
+{
+    /* Регулярное выражение перед полем должно просто пропускаться */
+    Builder b;
+    size_t top = b.Begin();
+    b.Key(0x0B, "re");
+    b.data.insert(b.data.end(), {'^', 'a', 0x0, 'i', 0x0});
+    b.Int32("num", 4);
+    b.Int32("type", 5);
+    b.End(top);
+
+    BSON_Document doc;
+    doc.data = b.data.data();
+    doc.size = (long)b.data.size();
+    BSON_Context ctx;
+    CHECK(BSON_Init(&doc, &ctx) == BSON_OPERATION_SUCCESS);
+
+    Param p;
+    CHECK(paramSchema.Decode(&ctx, &p) == BSON_OPERATION_SUCCESS);
+    CHECK(p.num == 4 && p.type == 5);
+
+    /* Поля события в документе нет */
+    Event event = {};
+    CHECK(eventSchema.Decode(&ctx, &event) == BSON_POS_OUT_OF_RANGE);
+
+    return EXIT_SUCCESS;
+}
+
+int main()
+{
+    if(Check_Event() || Check_Malformed() || Check_Skipped_Types())
+        return EXIT_FAILURE;
+
+    printf("schema_check: OK\n");
+    return EXIT_SUCCESS;
+}